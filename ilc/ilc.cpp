@@ -8,8 +8,22 @@ ILC::ILC(float fii, float gamma, float alpha) :
     gamma(gamma),
     alpha(alpha),
     is_enabled(false),
+    is_batch_mode(false),
+    is_deferred_update(false),
+    q_coeff(0.3),
+    lead_steps(5),
     iq_buffer(),
     error_buffer(),
+    iq_buffer_b(),
+    error_buffer_b(),
+    error_buffer_c(),
+    iq_active(iq_buffer),
+    iq_next(iq_buffer_b),
+    error_active(error_buffer),
+    error_pending(error_buffer_b),
+    error_previous(error_buffer_c),
+    is_revolution_pending(false),
+    is_clear_requested(false),
     idx(0),
     is_first_iteration(true),
     ramp_steps(2000) // 2000 * 500us = 1s
@@ -17,11 +31,18 @@ ILC::ILC(float fii, float gamma, float alpha) :
 }
 
 // Toggle ILC on / off.
-// Buffers are cleared, because the operating point may change
+// Buffers are cleared, because the operating point may change.
+// With deferred update the clear is left for processRevolution(), which may be
+// in the middle of writing the buffers.
 void ILC::toggle() {   
     if (is_enabled) {
         // Disable:
-        clearBuffers();
+        if (is_deferred_update) {
+            is_clear_requested.store(true, std::memory_order_release);
+        }
+        else {
+            clearBuffers();
+        }
         is_enabled = false;
         is_first_iteration = true;
     }
@@ -34,6 +55,15 @@ void ILC::toggle() {
 void ILC::clearBuffers() {
     memset(&iq_buffer, 0, sizeof(iq_buffer));
     memset(&error_buffer, 0, sizeof(error_buffer));
+    memset(&iq_buffer_b, 0, sizeof(iq_buffer_b));
+    memset(&error_buffer_b, 0, sizeof(error_buffer_b));
+    memset(&error_buffer_c, 0, sizeof(error_buffer_c));
+    iq_active.store(iq_buffer, std::memory_order_release);
+    iq_next = iq_buffer_b;
+    error_active = error_buffer;
+    error_pending = error_buffer_b;
+    error_previous = error_buffer_c;
+    is_revolution_pending.store(false, std::memory_order_release);
 }
 
 float ILC::clamp(float value, float lower_limit, float upper_limit) {
@@ -50,15 +80,111 @@ float ILC::clamp(float value, float lower_limit, float upper_limit) {
 float ILC::computeCompensation(float reference, float actual) {
     float iq_ref = 0.0;
     float error = reference - actual;
+    float* iq = iq_active.load(std::memory_order_relaxed);
 
     // Learn by using the following P-type learning law
-    iq_ref = (1 - alpha) * iq_buffer[idx] + phi * error_buffer[idx] + gamma * error;
+    iq_ref = (1 - alpha) * iq[idx] + phi * error_active[idx] + gamma * error;
 
-    iq_buffer[idx] = iq_ref;
-    error_buffer[idx] = error;
+    iq[idx] = iq_ref;
+    error_active[idx] = error;
     return iq_ref;
 }
 
+// Batch mode tick: store the error and return the correction learned on the
+// previous revolutions. The learning law is applied in onRevolution().
+float ILC::collectError(float reference, float actual) {
+    error_active[idx] = reference - actual;
+    return iq_active.load(std::memory_order_acquire)[idx];
+}
+
+// Called on the tick path when the rotor angle wraps around. The collected
+// errors are handed over to the revolution update and the next revolution is
+// written to the other error buffer.
+void ILC::onRevolution() {
+    // Previous revolution has not been processed yet: skip this one.
+    if (is_revolution_pending.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    float* errors = error_active;
+    error_active = error_pending;
+    error_pending = errors;
+    is_revolution_pending.store(true, std::memory_order_release);
+
+    if (!is_deferred_update) {
+        processRevolution();
+    }
+}
+
+// Applies the learning law to the pending revolution and publishes the result.
+// With deferred update this is meant to be called from a lower priority task.
+void ILC::processRevolution() {
+    if (is_clear_requested.load(std::memory_order_acquire)) {
+        clearBuffers();
+        is_clear_requested.store(false, std::memory_order_release);
+        return;
+    }
+    if (!is_revolution_pending.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    float* iq_previous = iq_active.load(std::memory_order_relaxed);
+    learnRevolution(error_pending, error_previous, iq_previous, iq_next);
+
+    // Publish the new buffer. Release ordering makes the writes of the learning
+    // law visible before the pointer, so the tick path always sees a complete buffer.
+    iq_active.store(iq_next, std::memory_order_release);
+    iq_next = iq_previous;
+
+    // The processed errors become the previous revolution, and the old previous
+    // buffer is handed back to the tick path for the next revolution.
+    float* errors = error_previous;
+    error_previous = error_pending;
+    error_pending = errors;
+    is_revolution_pending.store(false, std::memory_order_release);
+}
+
+// Revolution-batched learning law:
+// u_{j+1}(k) = Q[(1 - alpha) * u_j(k) + phi * e_{j-1}(k + lead_steps) + gamma * e_j(k + lead_steps)]
+// The buffers hold one period, so the phase lead wraps around the buffer end.
+// Loop is split in two to avoid the modulo in the inner loop.
+void ILC::learnRevolution(const float* errors, const float* errors_prev, const float* iq_in, float* iq_out) {
+    uint16_t lead = lead_steps % BUFFER_SIZE;
+    float forget = 1 - alpha;
+
+    for (uint16_t i = 0; i < BUFFER_SIZE - lead; i++) {
+        uint16_t k = i + lead;
+        iq_out[i] = forget * iq_in[i] + phi * errors_prev[k] + gamma * errors[k];
+    }
+    for (uint16_t i = BUFFER_SIZE - lead; i < BUFFER_SIZE; i++) {
+        uint16_t k = i + lead - BUFFER_SIZE;
+        iq_out[i] = forget * iq_in[i] + phi * errors_prev[k] + gamma * errors[k];
+    }
+
+    filterZeroPhase(iq_out);
+}
+
+// Q-filter: first order low-pass run forward and then backward over the buffer,
+// so that the phase lags of the two passes cancel out. The data is periodic,
+// hence each pass is started from the value at the opposite end of the buffer.
+void ILC::filterZeroPhase(float* data) {
+    if (q_coeff >= 1.0) {
+        return; // Filtering disabled
+    }
+
+    float state = data[BUFFER_LAST_IDX];
+    for (uint16_t i = 0; i < BUFFER_SIZE; i++) {
+        state += q_coeff * (data[i] - state);
+        data[i] = state;
+    }
+
+    state = data[0];
+    for (uint16_t i = BUFFER_SIZE; i-- > 0;) {
+        state += q_coeff * (data[i] - state);
+        data[i] = state;
+    }
+}
+
 // Handle the unlinearity that occurs on full rotations with [0, 1] angle.
 // Returns the corrected distance. Works on both directions (clockwise and counter clockwise).
 // Uses half circle to decide how to calculate the distance, so that unlinearity point is not crossed.
@@ -109,6 +235,7 @@ void ILC::interpolate(uint16_t start_idx, uint16_t end_idx, float array[BUFFER_S
 // Function updates index accordingly. The memory buffer must hold samples for single period.
 // This function increments the index so that the constant size memory will suffice.
 // rotor_angle: [0.0, 1.0]
+// Returns true when the angle has wrapped around, i.e. a revolution has been completed.
 boolean ILC::updateBufferIndex(float rotor_angle) {
     uint16_t previous_step_angle = idx;
 
@@ -120,13 +247,20 @@ boolean ILC::updateBufferIndex(float rotor_angle) {
     
     // If steps were skipped, then interpolate these. Ideally, never executed.
     // First angle difference tells nothing: avoid interpolating the whole array.
+    // In batch mode the correction terms are not written on the tick path.
     if (steps_forward > 1 && !is_first_iteration) {
-         interpolate(previous_step_angle, current_step_angle, iq_buffer);
-         interpolate(previous_step_angle, current_step_angle, error_buffer);
+         if (!is_batch_mode) {
+             interpolate(previous_step_angle, current_step_angle, iq_active.load(std::memory_order_relaxed));
+         }
+         interpolate(previous_step_angle, current_step_angle, error_active);
     }
+
+    // Large index jump means that the angle crossed the [0, 1] discontinuity.
+    bool has_wrapped = !is_first_iteration &&
+        abs(current_step_angle - previous_step_angle) > BUFFER_SIZE / 2;
     is_first_iteration = false;
 
-    return false;
+    return has_wrapped;
 }
 
 // Function handles the ILC state management and returns the desired compensation term.
@@ -134,8 +268,17 @@ float ILC::getCompensationTerm(float reference, float actual, float rotor_elec_a
     static float compensation = 0.0;
     static uint16_t step_idx = ramp_steps; 
 
+    // Buffers are being cleared by processRevolution(): ramp down as if disabled
+    bool is_active = is_enabled && !is_clear_requested.load(std::memory_order_acquire);
+
     // Normal mode (ILC enabled)
-    if (is_enabled) {
+    if (is_active && is_batch_mode) {
+        compensation = collectError(reference, actual);
+        if (updateBufferIndex(rotor_elec_angle)) {
+            onRevolution();
+        }
+    }
+    else if (is_active) {
         compensation = computeCompensation(reference, actual);
         updateBufferIndex(rotor_elec_angle);
     }
@@ -8,19 +8,39 @@
 #define BUFFER_SIZE 750
 #define BUFFER_LAST_IDX (BUFFER_SIZE-1)
 
+#include <atomic>
+
 class ILC {
 public:
     ILC(float fii, float gamma, float alpha);
     float getCompensationTerm(float reference, float actual, float rotor_angle);
     void toggle();
+    // Runs a pending batch update (call from a low priority task). Without deferred
+    // update it is called inside the wrap tick, which then runs the learning law
+    // over all BUFFER_SIZE samples and both Q-filter passes.
+    // With deferred update, toggle() only requests the buffer clear and this function
+    // does it, so the two may run concurrently. Otherwise this function must not run
+    // concurrently with toggle().
+    void processRevolution();
 
     float phi;         // ILC I-gain
     float gamma;       // ILC P-gain
     float alpha;       // Forgetting coefficient
     bool is_enabled;   // current module state
 
+    // Revolution-batched learning. phi is applied to the errors of the revolution
+    // before the latest one and gamma to the latest revolution.
+    bool is_batch_mode;      // Collect errors per tick, learn once per revolution
+    bool is_deferred_update; // Leave the batch update for processRevolution()
+    float q_coeff;           // Q-filter smoothing coefficient (0, 1], 1 = no filtering
+    uint16_t lead_steps;     // Phase lead of the learning law in buffer steps
+
 private:
     float computeCompensation(float reference, float actual);
+    float collectError(float reference, float actual);
+    void onRevolution();
+    void learnRevolution(const float* errors, const float* errors_prev, const float* iq_in, float* iq_out);
+    void filterZeroPhase(float* data);
     float clamp(float value, float lower_limit, float upper_limit);
     void clearBuffers();
 
@@ -31,6 +51,22 @@ private:
 
     float iq_buffer[BUFFER_SIZE];    // Memory for correction terms
     float error_buffer[BUFFER_SIZE]; // Memory for error terms
+
+    // Batch mode buffers. The tick path only touches the active buffers, while the
+    // revolution update reads the pending and previous errors and writes iq_next.
+    // iq_active and is_revolution_pending hand the buffers over between the tick
+    // and the update (release on store, acquire on load).
+    float iq_buffer_b[BUFFER_SIZE];
+    float error_buffer_b[BUFFER_SIZE];
+    float error_buffer_c[BUFFER_SIZE];
+    std::atomic<float*> iq_active;
+    float* iq_next;
+    float* error_active;
+    float* error_pending;
+    float* error_previous;
+    std::atomic<bool> is_revolution_pending;
+    std::atomic<bool> is_clear_requested; // deferred clear, tick path idles until done
+
     uint16_t idx;                    // Index for accessing the above buffers
     bool is_first_iteration;         // Due to feedback, the first iteration is not realiable.
     uint16_t ramp_steps;             // How fast the compensation term should be ramped down?
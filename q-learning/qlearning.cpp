@@ -14,16 +14,31 @@ Qtable::Qtable(float alpha, float gamma, float ek) :
     gamma(gamma),
     ek(ek),
     lambda(32.0),
+    trace_decay(0.9),
+    is_trace_mode(false),
     ripple_min(float(INIT_MAX)),    // set such initial values
     rotation_min(float(INIT_MAX)),  // values, that leave room
     rotation_max(float(-INIT_MAX)), // for improvement
     train_iterations(300000),
+    warm_start_iterations(30000),
+    op_slot(-1),
+    op_count(0),
+    op_speed_idx(0),
+    op_load_idx(0),
+    is_op_fallback(false),
+    has_last_state(false),
+    trace_head(0),
+    trace_count(0),
+    actual_prev(NAN),
     cumulative_reward(float(-INIT_MAX)),
+    has_full_revolution(false),
     max_average_reward(float(-INIT_MAX)),
     auto_zeta_search(true),
     N(500),
     save(false)
 {
+    memset(op_slots, -1, sizeof(op_slots));
+    setSeed(1);
 }
 
 // Reset initial state
@@ -33,6 +48,7 @@ void Qtable::resetState() {
     epsilon = 1.0;
     cumulative_reward = float(-INIT_MAX);
     max_average_reward = float(-INIT_MAX);
+    actual_prev = NAN;
 }
 
 // Fill table with zeroes
@@ -52,10 +68,16 @@ void Qtable::updateTargetTable(bool has_improved) {
 }
 
 // Loads the table, which must have the same structure as define in header.
+// The loaded table is used as the initial weights of every operating point.
 bool Qtable::loadTable() {
-    p_qtable = &qtable_weights; // used only for debugging
-    qtable_ptr = &qtable_weights[0][0];
-    qtable_target_ptr = &qtable_target_weights[0][0];
+    memset(op_slots, -1, sizeof(op_slots));
+    op_slot = -1;
+    op_count = 0;
+    op_speed_idx = 0;
+    op_load_idx = 0;
+    is_op_fallback = false;
+    op_slots[0][0] = allocateOperatingPoint(-1);
+    selectOperatingPoint(op_slots[0][0]);
     if (qtable_ptr != NULL) {
         linspaceAngles(angles, 0, 1.0);
         linspaceActions(actions, float(-T_MAX), float(T_MAX));
@@ -65,6 +87,147 @@ bool Qtable::loadTable() {
     return false; // load failed
 }
 
+// Takes a table from the pool. The table is warm-started from the source slot,
+// so that only warm_start_iterations of fine-tuning are left. Without a source
+// (-1) the loaded weights are used and the table is trained from scratch.
+// Returns the slot, or -1 if the pool has been exhausted.
+int8_t Qtable::allocateOperatingPoint(int8_t source_slot) {
+    if (op_count >= OP_POOL_SIZE) {
+        return -1;
+    }
+    OperatingPoint* op = &op_pool[op_count];
+    if (source_slot < 0) {
+        copyWeights(&qtable_weights[0][0], &op->weights[0][0]);
+        op->iteration_number = 0;
+    }
+    else {
+        // Progress of the slot in use is kept in the members until it is switched
+        uint32_t source_iterations = source_slot == op_slot ?
+            iteration_number : op_pool[source_slot].iteration_number;
+        uint32_t warm_iterations = train_iterations > warm_start_iterations ?
+            train_iterations - warm_start_iterations : 0;
+        copyWeights(&op_pool[source_slot].weights[0][0], &op->weights[0][0]);
+        op->iteration_number = source_iterations < warm_iterations ? source_iterations : warm_iterations;
+    }
+    copyWeights(&op->weights[0][0], &op->target_weights[0][0]);
+    op->max_average_reward = float(-INIT_MAX); // rewards differ between operating points
+    return op_count++;
+}
+
+// Stores the training progress of the current operating point and
+// takes the table of the given slot into use.
+void Qtable::selectOperatingPoint(int8_t slot) {
+    if (op_slot >= 0) {
+        op_pool[op_slot].iteration_number = iteration_number;
+        op_pool[op_slot].max_average_reward = max_average_reward;
+    }
+    OperatingPoint* op = &op_pool[slot];
+    op_slot = slot;
+    p_qtable = &op->weights;
+    qtable_ptr = &op->weights[0][0];
+    qtable_target_ptr = &op->target_weights[0][0];
+    iteration_number = op->iteration_number;
+    max_average_reward = op->max_average_reward;
+    epsilon = ek / (ek + iteration_number);
+    cumulative_reward = 0;
+    has_full_revolution = false; // the sum starts mid-revolution
+    has_last_state = false; // previous state-action belongs to the previous table
+    clearTraces();
+}
+
+// Returns the allocated slot closest to the given bins (Manhattan distance).
+// Bounded by the directory size, and only called when the bins change.
+int8_t Qtable::findNearestOperatingPoint(uint8_t speed_idx, uint8_t load_idx) {
+    int8_t nearest = op_slot;
+    uint8_t min_distance = 0xFF;
+    for (uint8_t i = 0; i < SPEED_NUM; i++) {
+        for (uint8_t j = 0; j < LOAD_NUM; j++) {
+            uint8_t distance = abs(i - speed_idx) + abs(j - load_idx);
+            if (op_slots[i][j] >= 0 && distance < min_distance) {
+                min_distance = distance;
+                nearest = op_slots[i][j];
+            }
+        }
+    }
+    return nearest;
+}
+
+// Maps absolute value in [0, max] to a bin in [0, n - 1].
+// The current bin is kept until the value is OP_HYSTERESIS bin widths past its edges,
+// so that noise at a bin edge does not switch tables every tick.
+uint8_t Qtable::getBin(float value, float max, uint8_t n, uint8_t current) {
+    float scaled = fabs(value) / max * n;
+    if (scaled > current - OP_HYSTERESIS && scaled < current + 1 + OP_HYSTERESIS) {
+        return current;
+    }
+    if (scaled >= n - 1) {
+        return n - 1;
+    }
+    return (uint8_t)scaled;
+}
+
+// Selects the table of the given operating point. Table is allocated from the pool
+// on the first visit. Lookup is constant time while the bins stay the same, and
+// never touches the heap. Returns false if the pool is exhausted, in which case
+// the nearest allocated table is used and training is paused (see train()).
+bool Qtable::setOperatingPoint(float speed, float load) {
+    uint8_t speed_idx = getBin(speed, float(SPEED_MAX), SPEED_NUM, op_speed_idx);
+    uint8_t load_idx = getBin(load, float(LOAD_MAX), LOAD_NUM, op_load_idx);
+    if (op_slot >= 0 && speed_idx == op_speed_idx && load_idx == op_load_idx) {
+        return !is_op_fallback;
+    }
+    op_speed_idx = speed_idx;
+    op_load_idx = load_idx;
+
+    int8_t slot = op_slots[speed_idx][load_idx];
+    int8_t nearest = slot;
+    if (slot < 0) {
+        nearest = findNearestOperatingPoint(speed_idx, load_idx);
+        slot = allocateOperatingPoint(nearest);
+        op_slots[speed_idx][load_idx] = slot;
+    }
+
+    is_op_fallback = slot < 0;
+    if (is_op_fallback) {
+        slot = nearest;
+    }
+    if (slot != op_slot) {
+        selectOperatingPoint(slot);
+    }
+    return !is_op_fallback;
+}
+
+// Applies the TD-update to every weight in the trace list.
+// Cost is proportional to the number of active traces, not to the table size.
+void Qtable::updateTraces(float step) {
+    float decay = gamma * trace_decay;
+    uint8_t i = trace_head;
+    for (uint8_t k = 0; k < trace_count; k++) {
+        i = (i == 0) ? TRACE_NUM - 1 : i - 1; // newest first
+        qtable_ptr[traces[i]] += step;
+        step *= decay;
+    }
+}
+
+// Adds a visited weight to the trace list. When the list is full,
+// the oldest trace (which also has the smallest value) is overwritten.
+void Qtable::pushTrace(uint16_t weight_idx) {
+    traces[trace_head] = weight_idx;
+    trace_head = (trace_head + 1) % TRACE_NUM;
+    if (trace_count < TRACE_NUM) {
+        trace_count++;
+    }
+}
+
+void Qtable::clearTraces() {
+    trace_head = 0;
+    trace_count = 0;
+}
+
+bool Qtable::isTrained() {
+    return iteration_number >= train_iterations;
+}
+
 void Qtable::linspaceAngles(float result[], float min, float max) {
     float step = (max - min) / (ANGLE_NUM - 1);
     for (uint16_t i = 0; i < ANGLE_NUM; i++) {
@@ -147,18 +310,70 @@ uint16_t Qtable::findClosestIdx(float arr[], uint16_t n, float target)
     return mid;
 }
 
+// The seed is hashed into the key, so that nearby seeds give unrelated keys.
+void Qtable::setSeed(uint32_t seed) {
+    seed ^= seed >> 16;
+    seed *= 0x7FEB352Du;
+    seed ^= seed >> 15;
+    seed *= 0x846CA68Bu;
+    seed ^= seed >> 16;
+    rng_key = seed;
+    rng_counter = 0;
+    random_idx = RANDOM_NUM; // forces refill on the next draw
+}
+
+// Generates the next block of random numbers. Each number depends only on
+// the key and the counter, hence the loop has no carried state.
+// The key is mixed in between the hash rounds (as in Philox), so streams of
+// different seeds are different permutations, not offsets of one sequence.
+void Qtable::fillRandomBuffer() {
+    uint32_t key_bumped = rng_key + 0x9E3779B9u;
+    for (uint8_t i = 0; i < RANDOM_NUM; i++) {
+        uint32_t x = rng_counter + i;
+        x ^= rng_key;
+        x ^= x >> 17;
+        x *= 0xED5AD4BBu;
+        x ^= key_bumped;
+        x ^= x >> 11;
+        x *= 0xAC4C1B51u;
+        x ^= rng_key;
+        x ^= x >> 15;
+        x *= 0x31848BABu;
+        x ^= x >> 14;
+        random_buffer[i] = x;
+    }
+    rng_counter += RANDOM_NUM;
+    random_idx = 0;
+}
+
+uint32_t Qtable::nextRandom() {
+    if (random_idx >= RANDOM_NUM) {
+        fillRandomBuffer();
+    }
+    return random_buffer[random_idx++];
+}
+
 // Get random number between 0.0 and 1.0
 float Qtable::getRandom() {
-    return (float)rand() / (float)RAND_MAX;
+    return (nextRandom() >> 8) * (1.0f / 16777216.0f); // 24 bits fit in float
 }
 
 // Get random integer between the provided range
+// Values below the threshold are rejected, so that modulo is not biased.
 uint16_t Qtable::getRandomInteger(uint16_t min, uint16_t max) {
-    return min + rand() / (RAND_MAX / (max - min + 1) + 1);
+    uint32_t range = max - min + 1;
+    uint32_t threshold = (0u - range) % range;
+    uint32_t x = nextRandom();
+    while (x < threshold) {
+        x = nextRandom();
+    }
+    return min + x % range;
 }
 
 float Qtable::getReward(float actual, float reference) {
-    static float actual_prev = actual; // add to class, shouldn't be static.
+    if (isnan(actual_prev)) {
+        actual_prev = actual;
+    }
 
     // The second part is much more important, hence the multiplier.
     float cost = fabs(actual - reference) + lambda * fabs(actual - actual_prev);
@@ -214,13 +429,16 @@ bool Qtable::updateRewardAverage(float reward) {
 
 // Updates class state
 void Qtable::update(float actual, uint16_t angle_idx) {
-    // Checks for massive index jumps, which indicate full electrical periods
-    if (abs(angle_idx - last_angle_idx) > (ANGLE_NUM / 2.0)) {
+    // Checks for massive index jumps, which indicate full electrical periods.
+    // After a table switch the last index is stale, and the sum up to the first
+    // wrap covers only a part of the revolution, so it is not compared.
+    if (has_last_state && abs(angle_idx - last_angle_idx) > (ANGLE_NUM / 2.0)) {
         average_reward = cumulative_reward / ANGLE_NUM;
-        if (average_reward > max_average_reward && train_iterations > 10000) {
+        if (has_full_revolution && average_reward > max_average_reward && train_iterations > 10000) {
             max_average_reward = average_reward;
             copyWeights(qtable_ptr, qtable_target_ptr);
         }
+        has_full_revolution = true;
         cumulative_reward = 0;
         hasImproved(actual, true); // for monitoring
     }
@@ -266,6 +484,13 @@ void Qtable::dumpTable() {
 
 float Qtable::train(float current_angle, float actual, float reference) {
 
+    // Operating point has no table of its own: act greedily with the nearest one.
+    if (is_op_fallback) {
+        has_last_state = false;
+        action = getBestAction(current_angle);
+        return action;
+    }
+
     // Keep exploring some times + avoid problems coming from iteration rollover.
     epsilon = epsilon <= 0.01 ? float(0.01) : epsilon = ek / (ek + iteration_number);   
 
@@ -273,7 +498,7 @@ float Qtable::train(float current_angle, float actual, float reference) {
     uint16_t angle_idx = findClosestIdx(angles, ANGLE_NUM, current_angle);
 
     // If the state has not changed, then we can just return the previous action
-    if (angle_idx == last_angle_idx) {
+    if (angle_idx == last_angle_idx && has_last_state) {
         update(actual, angle_idx);
         return action;
     }
@@ -286,7 +511,8 @@ float Qtable::train(float current_angle, float actual, float reference) {
     reward = getReward(actual, reference);
 
     // Decide a new action: get the best known action or explore
-    uint16_t action_idx = getRandom() > epsilon ? findMax(p_qtable[0][angle_idx]).idx : getRandomInteger(0, ACTION_NUM - 1);
+    struct Maximum best = findMax(Q_row_ptr);
+    uint16_t action_idx = getRandom() > epsilon ? best.idx : getRandomInteger(0, ACTION_NUM - 1);
     action = actions[action_idx];
     last_action_idx = action_idx;
 
@@ -294,8 +520,30 @@ float Qtable::train(float current_angle, float actual, float reference) {
     // Must be updated before touching the Q-table, because table-update is based on the last action.
     update(actual, angle_idx);
     
+    // Previous state-action is not from this table (first step after a switch)
+    if (!has_last_state) {
+        has_last_state = true;
+        clearTraces();
+        if (is_trace_mode) {
+            pushTrace(angle_idx * ACTION_NUM + action_idx);
+        }
+        return action;
+    }
+
     // Update the Q-table 
-    *Q_prev_ptr += alpha * (reward + gamma * findMax(Q_row_ptr).value - *Q_prev_ptr);
+    float delta = reward + gamma * findMax(Q_row_ptr).value - *Q_prev_ptr;
+    if (is_trace_mode) {
+        // Watkins Q(lambda): the reward is credited to the recent actions as well.
+        // Exploratory action breaks the greedy chain, so the traces are cut.
+        updateTraces(alpha * delta);
+        if (action_idx != best.idx) {
+            clearTraces();
+        }
+        pushTrace(angle_idx * ACTION_NUM + action_idx);
+    }
+    else {
+        *Q_prev_ptr += alpha * delta;
+    }
 
     return action;
 }
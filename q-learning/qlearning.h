@@ -12,14 +12,36 @@ class Qtable {
 #define T_MAX 0.12    // for memory allocation, hence #defines.
 typedef float qmatrix[ANGLE_NUM][ACTION_NUM];
 
+// Operating point grid. Each visited (speed, load) bin gets its own table
+// from a statically allocated pool, so the pool size bounds the memory use.
+#define SPEED_NUM 8     // Number of speed bins
+#define LOAD_NUM 4      // Number of load bins
+#define SPEED_MAX 1.0   // Speed range [0, SPEED_MAX] (absolute value)
+#define LOAD_MAX 1.0    // Load range [0, LOAD_MAX] (absolute value)
+#define OP_POOL_SIZE 8  // Max number of operating points having a table
+#define OP_HYSTERESIS 0.2 // Bin change hysteresis as a fraction of bin width
+
+#define TRACE_NUM 16    // Max length of the eligibility trace list
+
+#define RANDOM_NUM 32   // Random numbers generated at once
+
 public:
     Qtable(float alpha, float gamma, float e);
     bool loadTable();
+    // Selects the table in use. Returns false if the pool is exhausted: the nearest
+    // table is then used for actions, but training is paused until a point with
+    // its own table is selected again.
+    bool setOperatingPoint(float speed, float load);
+    bool isTrained(); // Has the current operating point finished training?
+    // Restarts the random number stream. Every instance starts from seed 1,
+    // so instances trained in parallel must be given their own seeds.
+    void setSeed(uint32_t seed);
     void clearTable(); // zeroes weights
     float getBestAction(float current_angle); // Returns the best known action
     float train(float angle, float actual, float reference);
 
     uint32_t train_iterations; // how long should train?
+    uint32_t warm_start_iterations; // how long should a point copied from its neighbour train?
     bool is_learning;
     float reward; // for monitoring
     float action;
@@ -30,6 +52,8 @@ public:
     float gamma;
     float ek;
     float lambda;
+    float trace_decay; // Q(lambda) trace decay (lambda is taken by the reward)
+    bool is_trace_mode; // Watkins Q(lambda) instead of one-step update
 
 private:
     float getReward(float actual, float reference);
@@ -40,6 +64,8 @@ private:
     void linspaceActions(float result[], float min, float max);
     float getRandom();
     uint16_t getRandomInteger(uint16_t min, uint16_t max);
+    uint32_t nextRandom();
+    void fillRandomBuffer();
     void resetState();
     void copyWeights(float* table1, float* table2);
     void hasFinishedTraining();
@@ -48,6 +74,21 @@ private:
     bool updateRewardAverage(float reward);
     void dumpTable();
     bool hasImproved(float actual, bool reset);
+    uint8_t getBin(float value, float max, uint8_t n, uint8_t current);
+    int8_t allocateOperatingPoint(int8_t source_slot);
+    int8_t findNearestOperatingPoint(uint8_t speed_idx, uint8_t load_idx);
+    void selectOperatingPoint(int8_t slot);
+    void updateTraces(float step);
+    void pushTrace(uint16_t weight_idx);
+    void clearTraces();
+
+    // Table and the training progress of a single operating point
+    struct OperatingPoint {
+        qmatrix weights;
+        qmatrix target_weights;
+        uint32_t iteration_number;
+        float max_average_reward;
+    };
 
     float rotation_min;
     float rotation_max;
@@ -57,7 +98,15 @@ private:
     float* qtable_ptr; // points to the first item
     qmatrix* p_qtable;
     float* qtable_target_ptr;
-    float qtable_target_weights[ANGLE_NUM][ACTION_NUM];
+
+    // Operating points: directory from bins to pool slots (-1: not visited)
+    OperatingPoint op_pool[OP_POOL_SIZE];
+    int8_t op_slots[SPEED_NUM][LOAD_NUM];
+    int8_t op_slot;   // slot in use
+    uint8_t op_count; // allocated slots
+    uint8_t op_speed_idx; // current bins
+    uint8_t op_load_idx;
+    bool is_op_fallback; // bins have no table, nearest one is used
 
     // Arrays used for converting weights to something sensible
     float angles[ANGLE_NUM];
@@ -67,10 +116,26 @@ private:
     // For the table update.
     uint16_t last_angle_idx;
     uint16_t last_action_idx;
+    bool has_last_state; // false until the above refer to the table in use
     uint32_t iteration_number;
 
+    // Eligibility traces: ring buffer of recently visited weight indices.
+    // The newest entry has trace 1 and the older ones decay by gamma * trace_decay.
+    uint16_t traces[TRACE_NUM];
+    uint8_t trace_head; // next write position
+    uint8_t trace_count;
+
+    // Counter-based random number generator. Output is the counter hashed with
+    // a key derived from the seed, so the stream is reproducible and per instance.
+    uint32_t rng_key;
+    uint32_t rng_counter;
+    uint32_t random_buffer[RANDOM_NUM];
+    uint8_t random_idx;
+    float actual_prev; // previous actual value for the reward (NAN: not set)
+
     // For finding the best weights
     float cumulative_reward;
+    bool has_full_revolution; // false until cumulative_reward covers a whole revolution
     float average_reward;
     float max_average_reward;
     bool auto_zeta_search;